@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "ahocorasick.h"
+
+/* Aho-Corasick automaton for case-insensitive substring matching of many
+ * patterns in one pass. Only bytes occurring in some pattern get their own
+ * column in the transition table, all other bytes share column 0. */
+struct ac {
+	char **patterns;
+	size_t npatterns;
+	unsigned char class[256];
+	int width;
+	int states;
+	int *delta;
+	char *match;
+};
+
+struct ac *ac_new(void)
+{
+	return calloc(1, sizeof(struct ac));
+}
+
+int ac_add(struct ac *ac, const char *pattern)
+{
+	char **patterns;
+
+	if (!*pattern)
+		return 0;
+
+	patterns = realloc(ac->patterns,
+			   (ac->npatterns + 1) * sizeof(char *));
+	if (!patterns)
+		return -1;
+	ac->patterns = patterns;
+
+	if (!(ac->patterns[ac->npatterns] = strdup(pattern)))
+		return -1;
+	ac->npatterns++;
+
+	return 0;
+}
+
+int ac_compile(struct ac *ac)
+{
+	size_t max_states = 1;
+	int width = 1;
+	int *fail, *queue;
+	int head = 0, tail = 0;
+
+	for (size_t i = 0; i < ac->npatterns; i++) {
+		for (unsigned char *p = (unsigned char *)ac->patterns[i]; *p;
+		     p++) {
+			int c = tolower(*p);
+			if (!ac->class[c]) {
+				ac->class[c] = width;
+				ac->class[toupper(c)] = width;
+				width++;
+			}
+			max_states++;
+		}
+	}
+
+	ac->width = width;
+	ac->delta = calloc(max_states * width, sizeof(int));
+	ac->match = calloc(max_states, 1);
+	fail = calloc(max_states, sizeof(int));
+	queue = calloc(max_states, sizeof(int));
+
+	if (!ac->delta || !ac->match || !fail || !queue) {
+		free(fail);
+		free(queue);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* trie, state 0 is the root and never a child */
+	ac->states = 1;
+	for (size_t i = 0; i < ac->npatterns; i++) {
+		int s = 0;
+		for (unsigned char *p = (unsigned char *)ac->patterns[i]; *p;
+		     p++) {
+			int *t = &ac->delta[s * width + ac->class[*p]];
+			if (!*t)
+				*t = ac->states++;
+			s = *t;
+		}
+		ac->match[s] = 1;
+		free(ac->patterns[i]);
+	}
+	free(ac->patterns);
+	ac->patterns = NULL;
+	ac->npatterns = 0;
+
+	/* turn the trie into a DFA by following failure links breadth first */
+	for (int c = 0; c < width; c++) {
+		int t = ac->delta[c];
+		if (t) {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+
+	while (head < tail) {
+		int s = queue[head++];
+		for (int c = 0; c < width; c++) {
+			int *t = &ac->delta[s * width + c];
+			int f = ac->delta[fail[s] * width + c];
+			if (*t) {
+				fail[*t] = f;
+				ac->match[*t] |= ac->match[f];
+				queue[tail++] = *t;
+			} else {
+				*t = f;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return 0;
+}
+
+int ac_match(const struct ac *ac, const char *text, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)text;
+	int s = 0;
+
+	if (!ac->delta)
+		return 0;
+
+	for (size_t i = 0; i < len; i++) {
+		s = ac->delta[s * ac->width + ac->class[p[i]]];
+		if (ac->match[s])
+			return 1;
+	}
+
+	return 0;
+}
+
+void ac_free(struct ac *ac)
+{
+	if (!ac)
+		return;
+
+	for (size_t i = 0; i < ac->npatterns; i++) {
+		free(ac->patterns[i]);
+	}
+	free(ac->patterns);
+	free(ac->delta);
+	free(ac->match);
+	free(ac);
+}
@@ -0,0 +1,6 @@
+struct ac;
+struct ac *ac_new(void);
+int ac_add(struct ac *ac, const char *pattern);
+int ac_compile(struct ac *ac);
+int ac_match(const struct ac *ac, const char *text, size_t len);
+void ac_free(struct ac *ac);
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>		/* flock(2) */
+#include <linux/limits.h>	/* PATH_MAX */
+
+#include "cache.h"
+#include "xxhash.h"
+
+/* A directory of feed bodies shared between users. Every url has an entry
+ * named after the hash of the url, holding the url on its first line and
+ * the body after it; its mtime is the time it was fetched. Entries are
+ * replaced atomically by rename(2), so readers need no lock. Fetchers hold
+ * an flock(2) on the entry's .lock file, so concurrent runs fetch each url
+ * only once. Anyone who can write to the directory can replace entries and
+ * so put tweets into every other user's timeline; share it only between
+ * users who trust each other. */
+
+static int cache_path(const char *dir, const char *url, const char *suffix,
+		      char *path)
+{
+	unsigned long long hash = xxh64(url, strlen(url), 0);
+
+	if (snprintf(path, PATH_MAX, "%s/%016llx%s", dir, hash, suffix)
+	    >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns a descriptor holding the lock on url's entry, or -1. The lock is
+ * polled for up to timeout ms; -1 with errno EWOULDBLOCK means someone
+ * else is still fetching it. */
+int cache_lock(const char *dir, const char *url, long timeout)
+{
+	struct timespec pause = { 0, 100 * 1000 * 1000 };
+	char path[PATH_MAX];
+	int fd;
+
+	if (cache_path(dir, url, ".lock", path) != 0)
+		return -1;
+
+	if ((fd = open(path, O_RDONLY | O_CREAT | O_NOFOLLOW, 0666)) == -1)
+		return -1;
+
+	// never block, the holder may be stuck on a stalled transfer
+	while (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		int saved = errno;
+
+		if (saved != EWOULDBLOCK || timeout <= 0) {
+			close(fd);
+			errno = saved;
+			return -1;
+		}
+		nanosleep(&pause, NULL);
+		timeout -= 100;
+	}
+
+	return fd;
+}
+
+void cache_unlock(int fd)
+{
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+/* Returns the body cached for url if it was fetched less than ttl seconds
+ * ago, NUL terminated, or NULL. */
+char *cache_read(const char *dir, const char *url, time_t ttl, size_t *size)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	size_t url_len = strlen(url);
+	char *data = NULL;
+	FILE *in;
+	int fd;
+
+	if (cache_path(dir, url, "", path) != 0)
+		return NULL;
+
+	// O_NONBLOCK so a fifo planted in the directory cannot hang us
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) == -1)
+		return NULL;
+
+	if (!(in = fdopen(fd, "r"))) {
+		close(fd);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+	    || st.st_mtime + ttl < time(NULL)
+	    || (size_t)st.st_size < url_len + 1)
+		goto out;
+
+	if (!(data = malloc(st.st_size + 1)))
+		goto out;
+
+	if (fread(data, 1, st.st_size, in) != (size_t)st.st_size
+	    || memcmp(data, url, url_len) != 0 || data[url_len] != '\n') {
+		free(data);
+		data = NULL;
+		goto out;
+	}
+
+	*size = st.st_size - url_len - 1;
+	memmove(data, data + url_len + 1, *size);
+	data[*size] = '\0';
+
+ out:
+	fclose(in);
+	return data;
+}
+
+int cache_write(const char *dir, const char *url, const char *data,
+		size_t size)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	FILE *out;
+	int fd;
+
+	if (cache_path(dir, url, "", path) != 0
+	    || snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path)
+	    >= (int)sizeof(tmp))
+		return -1;
+
+	/* The directory is writable by everyone, so the temporary file must
+	 * be created exclusively; mkstemp(3) never follows a planted link. */
+	if ((fd = mkstemp(tmp)) == -1)
+		return -1;
+
+	if (fchmod(fd, 0644) != 0 || !(out = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	fprintf(out, "%s\n", url);
+	fwrite(data, 1, size, out);
+
+	if (fclose(out) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+int cache_lock(const char *dir, const char *url, long timeout);
+void cache_unlock(int fd);
+char *cache_read(const char *dir, const char *url, time_t ttl, size_t *size);
+int cache_write(const char *dir, const char *url, const char *data,
+		size_t size);
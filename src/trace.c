@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#ifndef NO_TRACE
+
+struct trace_event {
+	char phase;
+	const char *name;
+	char *arg;
+	int64_t ts;
+};
+
+int trace_enabled;
+
+static char *trace_path;
+static struct trace_event *events;
+static size_t events_size;
+static size_t events_allocated;
+
+static void trace_string(FILE * out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", *s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void trace_write(void)
+{
+	FILE *out = fopen(trace_path, "w");
+	int pid = getpid();
+
+	if (!out) {
+		perror(trace_path);
+		return;
+	}
+
+	fputs("{\"traceEvents\":[\n", out);
+	for (size_t i = 0; i < events_size; i++) {
+		struct trace_event *e = &events[i];
+
+		fprintf(out, "{\"name\":");
+		trace_string(out, e->name);
+		fprintf(out, ",\"ph\":\"%c\",\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+			e->phase, (long long)e->ts, pid, pid);
+		if (e->arg) {
+			fputs(",\"args\":{\"arg\":", out);
+			trace_string(out, e->arg);
+			fputc('}', out);
+		}
+		fputs(i + 1 < events_size ? "},\n" : "}\n", out);
+		free(e->arg);
+	}
+	fputs("],\"displayTimeUnit\":\"ms\"}\n", out);
+
+	if (fclose(out) != 0)
+		perror(trace_path);
+
+	free(events);
+	free(trace_path);
+}
+
+int trace_open(const char *path)
+{
+	if (!(trace_path = strdup(path)))
+		return -1;
+
+	if (atexit(trace_write) != 0)
+		return -1;
+
+	trace_enabled = 1;
+	return 0;
+}
+
+void trace_event(char phase, const char *name, const char *arg)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (events_size == events_allocated) {
+		size_t n = events_allocated ? events_allocated * 2 : 1024;
+		struct trace_event *e =
+		    realloc(events, n * sizeof(struct trace_event));
+
+		if (!e) {
+			trace_enabled = 0;
+			return;
+		}
+		events = e;
+		events_allocated = n;
+	}
+
+	struct trace_event *e = &events[events_size++];
+	e->phase = phase;
+	e->name = name;
+	e->arg = arg ? strdup(arg) : NULL;
+	e->ts = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -0,0 +1,18 @@
+/* Chrome trace event recording, written to the file given to trace_open()
+ * at exit. Build with -DNO_TRACE to compile it out entirely. */
+#ifdef NO_TRACE
+#define trace_open(path) (-1)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_BEGIN_ARG(name, arg) ((void)0)
+#define TRACE_END(name) ((void)0)
+#else
+extern int trace_enabled;
+int trace_open(const char *path);
+void trace_event(char phase, const char *name, const char *arg);
+#define TRACE_BEGIN(name) \
+	(trace_enabled ? trace_event('B', name, NULL) : (void)0)
+#define TRACE_BEGIN_ARG(name, arg) \
+	(trace_enabled ? trace_event('B', name, arg) : (void)0)
+#define TRACE_END(name) \
+	(trace_enabled ? trace_event('E', name, NULL) : (void)0)
+#endif
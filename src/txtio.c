@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
@@ -13,55 +14,248 @@
 #include <libgen.h>		// basename
 #include <errno.h>
 #include <ctype.h> // iscntrl
+#include <limits.h>		// LLONG_MAX, INT_MAX
+#include <getopt.h>
+#include <sys/time.h>
 
 #include "mkdir.h"
+#include "ahocorasick.h"
+#include "xxhash.h"
+#include "trace.h"
+#include "cache.h"
 #include "uthash/utstring.h"
 #include "uthash/utarray.h"
+#include "uthash/uthash.h"
 
 char *time_format = "%Y-%m-%d %H:%S";
 char *pager_cmd = "less -R";
 int use_pager = 1;
+curl_off_t max_feed_size = 16 * 1024 * 1024;
+int max_parallel = 64;
+int max_attempts = 3;
+long retry_max_ms = 5000;	// slower failures wait for the next run
+int max_archive_depth = 64;
+struct ac *muted_words;
+uint64_t mutes_seed;
+char *cache_dir;
+time_t cache_ttl = 5 * 60;
+long cache_wait_ms = 60 * 1000;
+time_t backoff_min = 15 * 60;
+time_t backoff_max = 7 * 24 * 60 * 60;
 
 struct feed {
 	char *url;
 	char *nick;
+	CURL *curl;
 	UT_string *content;
 	long last_modified;
+	int depth;
+	UT_array *follows;
+	CURLcode result;
+	long response_code;
+	int attempts;
+	long retry_at;
+	int failures;
+	time_t next_retry;
+	time_t newest;
+	time_t next_poll;
+	time_t interval;
+	time_t oldest;
+	char *prev_hash;
+	char *prev_url;
+	char *archive_hash;
+	struct xxh64_state hash_state;
+	uint64_t digest;
+	uint64_t content_hash;
+	int content_hashed;
+	int cache_lock;
 };
 
+typedef void (*feed_done_cb) (struct feed * feed, void *data);
+
+/* content buffers of finished feeds, handed out again to later ones */
+UT_array *buffer_pool;
+
+UT_string *buffer_get(void)
+{
+	UT_string **p;
+	UT_string *s;
+
+	if (buffer_pool && (p = (UT_string **)utarray_back(buffer_pool))) {
+		s = *p;
+		utarray_pop_back(buffer_pool);
+		utstring_clear(s);
+		return s;
+	}
+
+	utstring_new(s);
+	return s;
+}
+
+void buffer_put(UT_string * s)
+{
+	if (!s)
+		return;
+
+	if (!buffer_pool)
+		utarray_new(buffer_pool, &ut_ptr_icd);
+
+	utarray_push_back(buffer_pool, &s);
+}
+
+void buffer_pool_free(void)
+{
+	UT_string **p = NULL;
+
+	if (!buffer_pool)
+		return;
+
+	while ((p = (UT_string **)utarray_next(buffer_pool, p))) {
+		utstring_free(*p);
+	}
+	utarray_free(buffer_pool);
+	buffer_pool = NULL;
+}
+
+struct feed *feed_new(const char *nick, const char *url)
+{
+	struct feed *feed = malloc(sizeof(struct feed));
+	if (!feed)
+		oom();
+
+	feed->nick = strdup(nick);
+	feed->url = strdup(url);
+	feed->curl = NULL;
+	feed->content = NULL;
+	feed->last_modified = 0;
+	feed->depth = 0;
+	feed->follows = NULL;
+	feed->result = CURLE_OK;
+	feed->response_code = 0;
+	feed->attempts = 0;
+	feed->retry_at = 0;
+	feed->failures = 0;
+	feed->next_retry = 0;
+	feed->newest = 0;
+	feed->next_poll = 0;
+	feed->interval = 0;
+	feed->oldest = 0;
+	feed->prev_hash = NULL;
+	feed->prev_url = NULL;
+	feed->archive_hash = NULL;
+	feed->digest = 0;
+	feed->content_hash = 0;
+	feed->content_hashed = 0;
+	xxh64_reset(&feed->hash_state, 0);
+	feed->cache_lock = -1;
+	return feed;
+}
+
 void feed_free(struct feed *feed)
 {
 	free(feed->url);
 	free(feed->nick);
-	free(feed->content);
+	free(feed->prev_hash);
+	free(feed->prev_url);
+	free(feed->archive_hash);
+	buffer_put(feed->content);
+	if (feed->follows) {
+		struct feed **p = NULL;
+		while ((p = (struct feed **)utarray_next(feed->follows, p))) {
+			feed_free(*p);
+		}
+		utarray_free(feed->follows);
+	}
 	free(feed);
 }
 
-struct tweet {
-	time_t timestamp;
-	char *msg;
-	char *nick;
+/* The timeline is kept as parallel arrays: tweet i was posted at
+ * timestamps[i] by nick_names[nicks[i]] and its message starts at
+ * text + msgs[i]. */
+struct tweets {
+	int64_t *timestamps;
+	size_t *msgs;
+	uint32_t *nicks;
+	size_t size;
+	size_t allocated;
+	UT_string *text;
+	UT_array *nick_names;
 };
 
-void tweet_free(struct tweet *tweet)
+struct tweets *tweets_new(void)
 {
-	free(tweet->msg);
-	free(tweet->nick);
-	free(tweet);
+	struct tweets *tweets = calloc(1, sizeof(struct tweets));
+	if (!tweets)
+		oom();
+
+	utstring_new(tweets->text);
+	utarray_new(tweets->nick_names, &ut_ptr_icd);
+	return tweets;
 }
 
-struct tweets {
-	struct tweet **data;
-	size_t size;
-	size_t allocated;
-};
+void tweets_free(struct tweets *tweets)
+{
+	free(tweets->timestamps);
+	free(tweets->msgs);
+	free(tweets->nicks);
+	utstring_free(tweets->text);
+	utarray_free(tweets->nick_names);
+	free(tweets);
+}
+
+void tweets_clear(struct tweets *tweets)
+{
+	tweets->size = 0;
+	utstring_clear(tweets->text);
+	utarray_clear(tweets->nick_names);
+}
 
-int tweets_compare(const void *s1, const void *s2)
+/* nick is not copied and has to outlive tweets */
+uint32_t tweets_add_nick(struct tweets *tweets, char *nick)
 {
-	struct tweet *t1 = *(struct tweet **)s1;
-	struct tweet *t2 = *(struct tweet **)s2;
-	time_t d = t2->timestamp - t1->timestamp;
-	return d == 0 ? 0 : d < 0 ? -1 : 1;
+	utarray_push_back(tweets->nick_names, &nick);
+	return utarray_len(tweets->nick_names) - 1;
+}
+
+void tweets_push(struct tweets *tweets, time_t timestamp, uint32_t nick,
+		 const char *msg, size_t msg_size)
+{
+	if (tweets->size == tweets->allocated) {
+		size_t n = tweets->allocated ? tweets->allocated * 2 : 256;
+
+		int64_t *timestamps =
+		    realloc(tweets->timestamps, n * sizeof(int64_t));
+		if (!timestamps)
+			oom();
+		tweets->timestamps = timestamps;
+
+		size_t *msgs = realloc(tweets->msgs, n * sizeof(size_t));
+		if (!msgs)
+			oom();
+		tweets->msgs = msgs;
+
+		uint32_t *nicks = realloc(tweets->nicks, n * sizeof(uint32_t));
+		if (!nicks)
+			oom();
+		tweets->nicks = nicks;
+
+		tweets->allocated = n;
+	}
+
+	UT_string *text = tweets->text;
+	size_t len = utstring_len(text);
+
+	if (text->n - len < msg_size + 2)
+		utstring_reserve(text, len > msg_size + 2 ? len : msg_size + 2);
+
+	tweets->timestamps[tweets->size] = timestamp;
+	tweets->msgs[tweets->size] = len;
+	tweets->nicks[tweets->size] = nick;
+	tweets->size++;
+
+	// keep the terminating NUL of every message
+	utstring_bincpy(text, msg, msg_size);
+	utstring_bincpy(text, "", 1);
 }
 
 time_t parse_timestamp(char **c)
@@ -88,23 +282,159 @@ time_t parse_timestamp(char **c)
 	*c = rest;
 
 	// TODO eval microseconds and timezone
-	while (**c != ' ' && **c != '\t') {
+	while (**c && **c != ' ' && **c != '\t') {
 		(*c)++;
 	}
 
 	return mktime(&tm);
 }
 
+/* Accepts a date with or without time, as in twtxt files. */
+time_t parse_date(const char *s)
+{
+	struct tm tm;
+	char *c = (char *)s;
+	char *rest;
+
+	time_t t = parse_timestamp(&c);
+	if (t != -1 && !*c)
+		return t;
+
+	memset(&tm, 0, sizeof(struct tm));
+	rest = strptime(s, "%Y-%m-%d", &tm);
+	if (!rest || *rest)
+		return -1;
+
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
 void skip_line(char **c)
 {
 	for (char *i = *c; *i && *i != '\n'; i++) ;
 }
 
-void parse_twtfile(struct feed *feed, UT_array * tweets)
+/* Resolves url relative to base, as archive links usually are. */
+char *url_resolve(const char *base, const char *url)
+{
+	CURLU *h = curl_url();
+	char *resolved = NULL;
+	char *result;
+
+	if (!h)
+		oom();
+
+	if (curl_url_set(h, CURLUPART_URL, base, 0) == CURLUE_OK
+	    && curl_url_set(h, CURLUPART_URL, url, 0) == CURLUE_OK)
+		curl_url_get(h, CURLUPART_URL, &resolved, 0);
+	curl_url_cleanup(h);
+
+	result = strdup(resolved ? resolved : url);
+	curl_free(resolved);
+	if (!result)
+		oom();
+	return result;
+}
+
+void parse_metadata(struct feed *feed, char **c)
+{
+	char *key, *key_end, *value, *value_end;
+
+	// skip #
+	(*c)++;
+
+	while (**c == ' ' || **c == '\t') {
+		(*c)++;
+	}
+
+	key = *c;
+	while (**c && **c != '\n' && **c != '='
+	       && !isspace((unsigned char)**c)) {
+		(*c)++;
+	}
+	key_end = *c;
+
+	while (**c == ' ' || **c == '\t') {
+		(*c)++;
+	}
+
+	if (**c != '=') {
+		while (**c && *(*c)++ != '\n') ;
+		return;
+	}
+	(*c)++;
+
+	while (**c == ' ' || **c == '\t') {
+		(*c)++;
+	}
+
+	value = *c;
+	while (**c && **c != '\n') {
+		(*c)++;
+	}
+	value_end = *c;
+	if (**c)
+		(*c)++;
+
+	while (value_end > value && isspace((unsigned char)value_end[-1])) {
+		value_end--;
+	}
+
+	// follow = nick url, prev = hash url
+	char *first_end = value;
+	while (first_end < value_end && !isspace((unsigned char)*first_end)) {
+		first_end++;
+	}
+
+	char *second = first_end;
+	while (second < value_end && isspace((unsigned char)*second)) {
+		second++;
+	}
+
+	if (first_end == value || second == value_end)
+		return;
+
+	if (feed->follows && key_end - key == 6 && !strncmp(key, "follow", 6)) {
+		char *nick = strndup(value, first_end - value);
+		char *url = strndup(second, value_end - second);
+		if (!nick || !url)
+			oom();
+
+		struct feed *follow = feed_new(nick, url);
+		follow->depth = feed->depth + 1;
+		utarray_push_back(feed->follows, &follow);
+
+		free(nick);
+		free(url);
+	} else if (key_end - key == 4 && !strncmp(key, "prev", 4)) {
+		char *url = strndup(second, value_end - second);
+		if (!url)
+			oom();
+
+		free(feed->prev_hash);
+		free(feed->prev_url);
+		feed->prev_hash = strndup(value, first_end - value);
+		feed->prev_url = url_resolve(feed->url, url);
+		free(url);
+	}
+}
+
+void parse_twtfile(struct feed *feed, struct tweets *tweets)
 {
+	if (!feed->content)
+		return;
+
+	TRACE_BEGIN_ARG("parse_twtfile", feed->url);
+
 	char *c = utstring_body(feed->content);
+	int64_t nick = -1;
 	while (*c) {
 
+		if (*c == '#') {
+			parse_metadata(feed, &c);
+			continue;
+		}
+
 		time_t timestamp = parse_timestamp(&c);
 
 		if (timestamp == -1) {
@@ -128,26 +458,26 @@ void parse_twtfile(struct feed *feed, UT_array * tweets)
 
 		size_t msg_size = c - start_msg;
 
-		struct tweet *t = malloc(sizeof(struct tweet));
-
-		if (!t)
-			oom();
+		// skip newline
+		if (*c)
+			c++;
 
-		t->msg = malloc(msg_size + 1);
+		if (!tweets)
+			continue;
 
-		if (!t->msg)
-			oom();
+		if (!feed->oldest || timestamp < feed->oldest)
+			feed->oldest = timestamp;
 
-		memcpy(&(t->msg[0]), start_msg, msg_size);
-		t->msg[msg_size] = 0;
-		t->timestamp = timestamp;
-		t->nick = feed->nick;
+		if (muted_words && ac_match(muted_words, start_msg, msg_size))
+			continue;
 
-		utarray_push_back(tweets, &t);
+		if (nick == -1)
+			nick = tweets_add_nick(tweets, feed->nick);
 
-		// skip newline
-		c++;
+		tweets_push(tweets, timestamp, nick, start_msg, msg_size);
 	}
+
+	TRACE_END("parse_twtfile");
 }
 
 static size_t
@@ -155,221 +485,1419 @@ feed_add_content(void *contents, size_t size, size_t nmemb, void *userp)
 {
 	size_t realsize = size * nmemb;
 	struct feed *feed = (struct feed *)userp;
+
+	if (!feed->content) {
+		curl_off_t length = -1;
+
+		feed->content = buffer_get();
+		curl_easy_getinfo(feed->curl,
+				  CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+		if (length > max_feed_size)
+			length = max_feed_size;
+		if (length > 0)
+			utstring_reserve(feed->content, (size_t)length + 1);
+	}
+
+	size_t len = utstring_len(feed->content);
+
+	if ((curl_off_t) (len + realsize) > max_feed_size) {
+		fprintf(stderr, "txtio: %s: feed exceeds %ld bytes, skipped\n",
+			feed->url, (long)max_feed_size);
+		return 0;
+	}
+
+	/* utstring_reserve only grows by what's asked for, so double instead
+	 * of reallocating for every chunk when Content-Length is unknown */
+	if (feed->content->n - len < realsize + 1)
+		utstring_reserve(feed->content,
+				 len > realsize + 1 ? len : realsize + 1);
+
 	utstring_bincpy(feed->content, contents, realsize);
+	xxh64_update(&feed->hash_state, contents, realsize);
 	return realsize;
 }
 
-void feed_process(CURL * e, UT_array * tweets)
+long now_ms(void)
 {
-	CURLcode res;
-	long code;
-	res = curl_easy_getinfo(e, CURLINFO_RESPONSE_CODE, &code);
-	if (res != CURLE_OK)
-		return;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	struct feed *feed;
+int feed_ok(struct feed *feed)
+{
+	return feed->result == CURLE_OK && (feed->response_code == 0
+					    || feed->response_code == 200
+					    || feed->response_code == 304);
+}
 
-	switch (code) {
-	case 0:
-	case 200:
-		//TODO check res!
-		res = curl_easy_getinfo(e, CURLINFO_PRIVATE, &feed);
-		res = curl_easy_getinfo(e,
-					CURLINFO_FILETIME,
-					&(feed->last_modified));
-		parse_twtfile(feed, tweets);
+/* Whether the body just received differs from the one last parsed. The
+ * digest is seeded with the mute rules, so changing them counts too. */
+int feed_content_changed(struct feed *feed)
+{
+	int changed = !feed->content_hashed
+	    || feed->digest != feed->content_hash;
+
+	feed->content_hash = feed->digest;
+	feed->content_hashed = 1;
+	return changed;
+}
+
+/* Whether a failed fetch may succeed when tried again shortly. Timeouts
+ * are left to the backoff between runs, retrying them costs too long. */
+int feed_transient_error(struct feed *feed)
+{
+	switch (feed->result) {
+	case CURLE_OK:
 		break;
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_SSL_CONNECT_ERROR:
+		return 1;
+	default:
+		return 0;
+	}
+
+	switch (feed->response_code) {
+	case 408:
+	case 429:
+	case 500:
+	case 502:
+	case 503:
+	case 504:
+		return 1;
 	}
+
+	return 0;
 }
 
-UT_array *feeds_get(UT_array * feeds)
+void feed_error(struct feed *feed, char *buf, size_t size)
 {
-	curl_global_init(CURL_GLOBAL_SSL);
-	CURLM *multi_handle = curl_multi_init();
-
-	int still_running = 0;
+	if (feed->result != CURLE_OK)
+		snprintf(buf, size, "%s", curl_easy_strerror(feed->result));
+	else
+		snprintf(buf, size, "HTTP %ld", feed->response_code);
+}
 
-	struct feed **p = NULL;
+/* Updates the failure count and next retry time after the last attempt. */
+void feed_backoff(struct feed *feed, time_t now)
+{
+	if (feed_ok(feed)) {
+		feed->failures = 0;
+		feed->next_retry = 0;
+		return;
+	}
 
-	while ((p = (struct feed **)utarray_next(feeds, p))) {
-		struct feed *feed = *p;
-		CURL *c;
+	time_t delay = backoff_min;
+	for (int i = 0; i < feed->failures && delay < backoff_max; i++) {
+		delay *= 2;
+	}
+	if (delay > backoff_max)
+		delay = backoff_max;
 
-		if ((c = curl_easy_init())) {
+	feed->failures++;
+	feed->next_retry = now + delay + random() % (delay / 4 + 1);
+}
 
-			curl_easy_setopt(c, CURLOPT_WRITEFUNCTION,
-					 feed_add_content);
-			curl_easy_setopt(c, CURLOPT_WRITEDATA, (void *)feed);
-			curl_easy_setopt(c, CURLOPT_PRIVATE, (void *)feed);
-			curl_easy_setopt(c, CURLOPT_URL, feed->url);
-			curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1);
-			curl_easy_setopt(c, CURLOPT_FILETIME, 1);
-			curl_easy_setopt(c, CURLOPT_USERAGENT, "txtio/1.0");
+/* Returns 1 if the feed should be tried again in this run. */
+int feed_process(CURL * e, CURLcode result, feed_done_cb done, void *data)
+{
+	CURLcode res;
+	struct feed *feed;
+	curl_off_t elapsed = 0;
+	int retry = 0;
 
-			curl_multi_add_handle(multi_handle, c);
+	res = curl_easy_getinfo(e, CURLINFO_PRIVATE, &feed);
+	if (res != CURLE_OK)
+		return 0;
+
+	curl_easy_getinfo(e, CURLINFO_TOTAL_TIME_T, &elapsed);
+
+	feed->attempts++;
+	feed->result = result;
+	feed->response_code = 0;
+
+	if (result == CURLE_FILESIZE_EXCEEDED)
+		fprintf(stderr, "txtio: %s: feed exceeds %ld bytes, skipped\n",
+			feed->url, (long)max_feed_size);
+
+	if (result == CURLE_OK)
+		curl_easy_getinfo(e, CURLINFO_RESPONSE_CODE,
+				  &feed->response_code);
+
+	if (feed_ok(feed)) {
+		// 304: nothing new since last_modified
+		if (feed->response_code != 304) {
+			res = curl_easy_getinfo(e,
+						CURLINFO_FILETIME,
+						&(feed->last_modified));
+			feed->digest = xxh64_digest(&feed->hash_state);
+			if (feed->cache_lock != -1 && feed->content)
+				cache_write(cache_dir, feed->url,
+					    utstring_body(feed->content),
+					    utstring_len(feed->content));
+			done(feed, data);
 		}
+	} else if (feed_transient_error(feed)
+		   && feed->attempts < max_attempts
+		   && elapsed / 1000 < retry_max_ms) {
+		/* 1s, 2s, ... plus up to a second of jitter */
+		feed->retry_at = now_ms() + (500L << feed->attempts)
+		    + random() % 1000;
+		retry = 1;
 	}
 
-	int repeats = 0;
-	/* we start some action by calling perform right away */
-	curl_multi_perform(multi_handle, &still_running);
-
-	UT_array *tweets;
+	if (!retry && feed->cache_lock != -1) {
+		cache_unlock(feed->cache_lock);
+		feed->cache_lock = -1;
+	}
 
-	utarray_new(tweets, &ut_ptr_icd);
+	/* tweets are copied out, so the buffer can serve the next feed */
+	buffer_put(feed->content);
+	feed->content = NULL;
+	feed->curl = NULL;
+	return retry;
+}
 
-	do {
-		CURLMcode mc;
-		int numfds;
+/* Returns 0 once the transfer is added to multi_handle, -1 otherwise. */
+int feed_start(CURLM * multi_handle, struct feed *feed)
+{
+	CURL *c;
 
-		/* wait for activity, timeout or "nothing" */
-		mc = curl_multi_wait(multi_handle, NULL, 0, 1000, &numfds);
+	if (!(c = curl_easy_init()))
+		return -1;
 
-		if (mc != CURLM_OK) {
-			fprintf(stderr, "%s\n", curl_multi_strerror(mc));
-			break;
-		}
+	feed->curl = c;
+	xxh64_reset(&feed->hash_state, mutes_seed);
+	curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, feed_add_content);
+	curl_easy_setopt(c, CURLOPT_WRITEDATA, (void *)feed);
+	curl_easy_setopt(c, CURLOPT_PRIVATE, (void *)feed);
+	curl_easy_setopt(c, CURLOPT_URL, feed->url);
+	curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(c, CURLOPT_FILETIME, 1);
+	curl_easy_setopt(c, CURLOPT_USERAGENT, "txtio/1.0");
+	curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, 30L);
+	// give up on stalled transfers, others may be waiting on the lock
+	curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, 30L);
+	curl_easy_setopt(c, CURLOPT_MAXFILESIZE_LARGE, max_feed_size);
+
+	if (feed->last_modified > 0) {
+		curl_easy_setopt(c, CURLOPT_TIMECONDITION,
+				 CURL_TIMECOND_IFMODSINCE);
+		curl_easy_setopt(c, CURLOPT_TIMEVALUE, feed->last_modified);
+	}
 
-		/* 'numfds' being zero means either a timeout or no file descriptors to
-		 * wait for. Try timeout on first occurrence, then assume no file
-		 * descriptors and no file descriptors to wait for means wait for 100
-		 * milliseconds. */
+	if (curl_multi_add_handle(multi_handle, c) != CURLM_OK) {
+		curl_easy_cleanup(c);
+		feed->curl = NULL;
+		return -1;
+	}
 
-		if (!numfds) {
-			repeats++;	/* count number of repeated zero numfds */
-			if (repeats > 1) {
-				struct timeval wait = { 0, 100000 };
-				(void)select(0, NULL, NULL, NULL, &wait);
+	return 0;
+}
 
-			}
-		} else {
-			repeats = 0;
-		}
+/* A multi handle with the feeds currently in flight. done is called for
+ * every successful fetch, finished, if set, for every feed that is given
+ * up on or done with. */
+struct fetcher {
+	CURLM *multi_handle;
+	int active;
+	int repeats;
+	UT_array *retries;
+	feed_done_cb done;
+	feed_done_cb finished;
+	void *data;
+};
 
-		mc = curl_multi_perform(multi_handle, &still_running);
+void fetcher_init(struct fetcher *f, feed_done_cb done,
+		  feed_done_cb finished, void *data)
+{
+	curl_global_init(CURL_GLOBAL_SSL);
+	f->multi_handle = curl_multi_init();
+	f->active = 0;
+	f->repeats = 0;
+	utarray_new(f->retries, &ut_ptr_icd);
+	f->done = done;
+	f->finished = finished;
+	f->data = data;
+}
 
-		int msgq = 0;
-		struct CURLMsg *m;
-		while ((m = curl_multi_info_read(multi_handle, &msgq)) != NULL) {
-			if (m->msg == CURLMSG_DONE) {
-				CURL *e = m->easy_handle;
-				feed_process(e, tweets);
-				curl_multi_remove_handle(multi_handle, e);
-				curl_easy_cleanup(e);
+void fetcher_cleanup(struct fetcher *f)
+{
+	utarray_free(f->retries);
+	curl_multi_cleanup(f->multi_handle);
+	curl_global_cleanup();
+	buffer_pool_free();
+}
 
-			}
+/* A feed that cannot be started counts as a failed attempt and is
+ * finished right away, it must not be counted as active. */
+void fetcher_start(struct fetcher *f, struct feed *feed)
+{
+	if (feed_start(f->multi_handle, feed) == 0) {
+		f->active++;
+		return;
+	}
 
-		}
+	feed->attempts++;
+	feed->result = CURLE_FAILED_INIT;
+	feed->response_code = 0;
 
+	if (feed->cache_lock != -1) {
+		cache_unlock(feed->cache_lock);
+		feed->cache_lock = -1;
 	}
-	while (still_running);
 
-	curl_multi_cleanup(multi_handle);
-	curl_global_cleanup();
-	return tweets;
+	if (f->finished)
+		f->finished(feed, f->data);
 }
 
-void tweets_sort(UT_array * tweets)
+int fetcher_idle(struct fetcher *f)
 {
-	utarray_sort(tweets, tweets_compare);
+	return !f->active && !utarray_len(f->retries);
 }
 
-void tweets_display(UT_array * tweets)
+/* Drives the transfers once and waits up to timeout ms for activity. */
+void fetcher_poll(struct fetcher *f, int timeout)
 {
+	CURLMcode mc;
+	int numfds;
+	int still_running = 0;
+	long now = now_ms();
+
+	for (unsigned i = 0;
+	     f->active < max_parallel && i < utarray_len(f->retries);) {
+		struct feed **p = (struct feed **)utarray_eltptr(f->retries, i);
+		if ((*p)->retry_at <= now) {
+			fetcher_start(f, *p);
+			utarray_erase(f->retries, i, 1);
+		} else {
+			if ((*p)->retry_at - now < timeout)
+				timeout = (*p)->retry_at - now;
+			i++;
+		}
+	}
 
-	FILE *pager = stdout;
-	if (use_pager) {
-		pager = popen(pager_cmd, "w");
+	mc = curl_multi_perform(f->multi_handle, &still_running);
+
+	int msgq = 0;
+	struct CURLMsg *m;
+	while ((m = curl_multi_info_read(f->multi_handle, &msgq)) != NULL) {
+		if (m->msg == CURLMSG_DONE) {
+			CURL *e = m->easy_handle;
+			struct feed *feed;
+
+			curl_easy_getinfo(e, CURLINFO_PRIVATE, &feed);
+			if (feed_process(e, m->data.result, f->done, f->data))
+				utarray_push_back(f->retries, &feed);
+			else if (f->finished)
+				f->finished(feed, f->data);
+			curl_multi_remove_handle(f->multi_handle, e);
+			curl_easy_cleanup(e);
+			f->active--;
+		}
 	}
 
-	struct tweet **tweet = NULL;
+	if (timeout <= 0 || fetcher_idle(f))
+		return;
 
-	while ((tweet = (struct tweet **)utarray_next(tweets, tweet))) {
+	/* wait for activity, timeout or "nothing" */
+	mc = curl_multi_wait(f->multi_handle, NULL, 0, timeout, &numfds);
 
-		struct tweet *t = *tweet;
+	if (mc != CURLM_OK) {
+		fprintf(stderr, "%s\n", curl_multi_strerror(mc));
+		return;
+	}
 
-		time_t d = t->timestamp;
-		size_t buffer_size = 50;
-		char *timestamp = malloc(sizeof(char) * buffer_size);
-		if (!timestamp)
-			oom();
+	/* 'numfds' being zero means either a timeout or no file descriptors to
+	 * wait for. Try timeout on first occurrence, then assume no file
+	 * descriptors and no file descriptors to wait for means wait for 100
+	 * milliseconds. */
 
-		while (strftime(timestamp, buffer_size, time_format,
-				localtime(&d)) == 0) {
-			timestamp = realloc(timestamp, buffer_size * 2);
-			if (!timestamp) {
-				oom();
-			}
-			buffer_size *= 2;
-		}
+	if (!numfds) {
+		f->repeats++;	/* count number of repeated zero numfds */
+		if (f->repeats > 1) {
+			struct timeval wait = { 0, 100000 };
+			(void)select(0, NULL, NULL, NULL, &wait);
 
-		fprintf(pager, "* %s (%s)\n%s\n\n", t->nick, timestamp, t->msg);
+		}
+	} else {
+		f->repeats = 0;
 	}
-
-	fclose(pager);
 }
 
-int sql_do(sqlite3 * db, const char *sql)
-{
-	return sqlite3_exec(db, sql, NULL, NULL, NULL);
-}
+enum { CACHE_HIT, CACHE_FETCH, CACHE_BUSY };
 
-void database_create(const char *filename)
+/* Serves feed from the shared cache directory if it was fetched less than
+ * cache_ttl seconds ago. Otherwise takes the lock on its entry, so the
+ * caller can fetch it; CACHE_BUSY means another process still held the
+ * lock after wait ms. */
+int feed_from_cache(struct feed *feed, long wait, feed_done_cb done,
+		    void *data)
 {
-	sqlite3 *db;
-	int rc = sqlite3_open(filename, &db);
+	size_t size;
+	char *body;
 
-	if (rc == SQLITE_OK) {
-		sql_do(db,
-		       "create table followings"
-		       "(nick text unique, url text unique, last_modified )");
+	if (!cache_dir)
+		return CACHE_FETCH;
+
+	if (!(body = cache_read(cache_dir, feed->url, cache_ttl, &size))) {
+		feed->cache_lock = cache_lock(cache_dir, feed->url, wait);
+		if (feed->cache_lock == -1)
+			return errno == EWOULDBLOCK ? CACHE_BUSY : CACHE_FETCH;
+
+		// it may have been stored while we were waiting
+		if (!(body = cache_read(cache_dir, feed->url, cache_ttl,
+					&size)))
+			return CACHE_FETCH;
+
+		cache_unlock(feed->cache_lock);
+		feed->cache_lock = -1;
 	}
 
-	sqlite3_close(db);
+	feed->content = buffer_get();
+	utstring_bincpy(feed->content, body, size);
+	feed->digest = xxh64(body, size, mutes_seed);
+	feed->result = CURLE_OK;
+	feed->response_code = 200;
+	free(body);
+
+	done(feed, data);
+
+	buffer_put(feed->content);
+	feed->content = NULL;
+	return CACHE_HIT;
 }
 
-int timeline(const char *filename)
+/* Fetches all feeds, at most max_parallel at a time, and calls done for
+ * every successful one. done may append further feeds to the array.
+ * Transient errors are retried up to max_attempts times. With cache_dir
+ * set, fresh feeds come from there and fetched ones are stored in it;
+ * feeds another process is fetching are waited for up to cache_wait_ms
+ * and then fetched here. */
+void feeds_fetch(UT_array * feeds, feed_done_cb done, void *data)
 {
+	struct fetcher f;
+	unsigned next = 0;
+	UT_array *waiting;
+	long wait_until = 0;
+
+	utarray_new(waiting, &ut_ptr_icd);
+	fetcher_init(&f, done, NULL, data);
+
+	for (;;) {
+		while (f.active < max_parallel) {
+			struct feed *feed;
+			int waited = 0;
+			long wait = 0;
+
+			if (next < utarray_len(feeds)) {
+				feed = *(struct feed **)
+				    utarray_eltptr(feeds, next);
+				next++;
+			} else if (fetcher_idle(&f) && utarray_len(waiting)) {
+				// fetched by someone else, wait for their result
+				long now = now_ms();
+
+				if (!wait_until)
+					wait_until = now + cache_wait_ms;
+				if (wait_until > now)
+					wait = wait_until - now;
+				feed = *(struct feed **)utarray_back(waiting);
+				utarray_pop_back(waiting);
+				waited = 1;
+			} else {
+				break;
+			}
 
-	sqlite3 *db;
-	int rc = EXIT_SUCCESS;
-	// char *err_msg;
+			switch (feed_from_cache(feed, wait, done, data)) {
+			case CACHE_FETCH:
+				fetcher_start(&f, feed);
+				break;
+			case CACHE_BUSY:
+				// past the deadline we fetch it ourselves
+				if (waited)
+					fetcher_start(&f, feed);
+				else
+					utarray_push_back(waiting, &feed);
+				break;
+			}
+		}
 
-	sqlite3_stmt *stmt;
+		if (fetcher_idle(&f) && next == utarray_len(feeds)
+		    && !utarray_len(waiting))
+			break;
 
-	rc = sqlite3_open(filename, &db);
-	if (rc != SQLITE_OK) {
-		return EXIT_FAILURE;
+		/* free slots can be refilled right away */
+		TRACE_BEGIN("fetcher_poll");
+		fetcher_poll(&f, f.active < max_parallel
+			     && next < utarray_len(feeds) ? 0 : 1000);
+		TRACE_END("fetcher_poll");
 	}
 
-	rc = sqlite3_prepare_v2(db, "select nick, url from followings", -1,
-				&stmt, NULL);
+	utarray_free(waiting);
+	fetcher_cleanup(&f);
+}
 
-	if (rc != SQLITE_OK) {
-		return EXIT_FAILURE;
-	}
+void feed_parse_tweets(struct feed *feed, void *tweets)
+{
+	parse_twtfile(feed, tweets);
+}
 
-	UT_array *feeds;
-	utarray_new(feeds, &ut_ptr_icd);
+struct tweets *feeds_get(UT_array * feeds)
+{
+	struct tweets *tweets = tweets_new();
 
-	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-		struct feed *feed = malloc(sizeof(struct feed));
-		if (!feed) {
-			exit(EXIT_FAILURE);
-		}
-		feed->nick = strdup((const char *)sqlite3_column_text(stmt, 0));
-		feed->url = strdup((const char *)sqlite3_column_text(stmt, 1));
+	feeds_fetch(feeds, feed_parse_tweets, tweets);
+	return tweets;
+}
+
+struct content_range {
+	curl_off_t first;
+	curl_off_t total;
+};
+
+static size_t
+feed_content_range(char *buffer, size_t size, size_t nitems, void *userp)
+{
+	size_t realsize = size * nitems;
+	struct content_range *range = (struct content_range *)userp;
+	long long first, last, total;
+
+	if (realsize > 14 && strncasecmp(buffer, "content-range:", 14) == 0
+	    && sscanf(buffer + 14, " bytes %lld-%lld/%lld", &first, &last,
+		      &total) == 3) {
+		range->first = first;
+		range->total = total;
+	}
+
+	return realsize;
+}
+
+/* Counts the tweets in s, whose first line is skipped if cut off. */
+size_t count_tweets(char *s, int cut_off)
+{
+	size_t count = 0;
+	char *c = s;
+
+	if (cut_off) {
+		while (*c && *c++ != '\n') ;
+	}
+
+	while (*c) {
+		char *line = c;
+
+		if (*c != '#' && parse_timestamp(&line) != -1)
+			count++;
+		while (*c && *c++ != '\n') ;
+	}
+
+	return count;
+}
+
+/* Fetches the end of feed with backward Range requests, doubling the chunk
+ * size until it holds n complete tweets or reaches the start of the file.
+ * Servers ignoring Range answer with the whole feed, which is used as is.
+ * Returns 0 on success. */
+int feed_get_tail(struct feed *feed, size_t n)
+{
+	struct content_range range;
+	UT_string *tail;
+	curl_off_t chunk = n * 512 < 4096 ? 4096 : n * 512;
+	curl_off_t start = -1;
+	curl_off_t total = -1;
+	char bytes[64];
+	int rc = -1;
+
+	CURL *c = curl_easy_init();
+	if (!c)
+		return -1;
+
+	utstring_new(tail);
+	feed->curl = c;
+	curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, feed_add_content);
+	curl_easy_setopt(c, CURLOPT_WRITEDATA, (void *)feed);
+	curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, feed_content_range);
+	curl_easy_setopt(c, CURLOPT_HEADERDATA, (void *)&range);
+	curl_easy_setopt(c, CURLOPT_URL, feed->url);
+	curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(c, CURLOPT_USERAGENT, "txtio/1.0");
+	curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, 30L);
+	// give up on stalled transfers, others may be waiting on the lock
+	curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, 30L);
+	curl_easy_setopt(c, CURLOPT_MAXFILESIZE_LARGE, max_feed_size);
+
+	for (;;) {
+		long code = 0;
+
+		if (start == -1) {
+			snprintf(bytes, sizeof(bytes), "-%lld", (long long)chunk);
+		} else {
+			curl_off_t first = start > chunk ? start - chunk : 0;
+			snprintf(bytes, sizeof(bytes), "%lld-%lld",
+				 (long long)first, (long long)start - 1);
+		}
+		curl_easy_setopt(c, CURLOPT_RANGE, bytes);
+
+		range.first = -1;
+		range.total = -1;
+		feed->content = NULL;
+
+		if (curl_easy_perform(c) != CURLE_OK)
+			break;
+		curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+
+		if (code == 200 || (code == 206 && total != -1
+				    && range.total != total)) {
+			// no range support, or the feed changed underneath us
+			if (code == 206) {
+				buffer_put(feed->content);
+				feed->content = NULL;
+				curl_easy_setopt(c, CURLOPT_RANGE, NULL);
+				if (curl_easy_perform(c) != CURLE_OK)
+					break;
+			}
+			utstring_free(tail);
+			tail = feed->content;
+			feed->content = NULL;
+			start = 0;
+			rc = 0;
+			break;
+		}
+
+		if (code == 416) {
+			// empty feed
+			rc = 0;
+			break;
+		}
+
+		if (code != 206 || range.first == -1)
+			break;
+
+		if (feed->content) {
+			utstring_concat(feed->content, tail);
+			utstring_free(tail);
+			tail = feed->content;
+			feed->content = NULL;
+		}
+
+		start = range.first;
+		total = range.total;
+
+		if (!start || (curl_off_t) utstring_len(tail) >= max_feed_size
+		    || count_tweets(utstring_body(tail), 1) >= n) {
+			rc = 0;
+			break;
+		}
+
+		chunk *= 2;
+	}
+
+	if (rc == 0 && start > 0) {
+		// drop the line cut off by the range
+		char *c = utstring_body(tail);
+		while (*c && *c++ != '\n') ;
 		utstring_new(feed->content);
+		utstring_bincpy(feed->content, c,
+				utstring_len(tail) - (c - utstring_body(tail)));
+		utstring_free(tail);
+	} else if (tail) {
+		buffer_put(feed->content);
+		feed->content = tail;
+	}
+
+	curl_easy_cleanup(c);
+	feed->curl = NULL;
+	return rc;
+}
+
+int sql_do(sqlite3 * db, const char *sql)
+{
+	return sqlite3_exec(db, sql, NULL, NULL, NULL);
+}
+
+struct archive_load {
+	struct tweets *tweets;
+	sqlite3_stmt *insert;
+};
+
+void feed_parse_archive(struct feed *feed, void *data)
+{
+	struct archive_load *a = data;
+
+	// store before parse_twtfile() blanks out control characters
+	if (a->insert && feed->content) {
+		sqlite3_bind_text(a->insert, 1, feed->url, -1, SQLITE_STATIC);
+		sqlite3_bind_text(a->insert, 2, feed->archive_hash, -1,
+				  SQLITE_STATIC);
+		sqlite3_bind_blob(a->insert, 3, utstring_body(feed->content),
+				  utstring_len(feed->content), SQLITE_STATIC);
+		sqlite3_step(a->insert);
+		sqlite3_reset(a->insert);
+	}
+
+	parse_twtfile(feed, a->tweets);
+}
+
+int archive_cached(sqlite3_stmt * select, struct feed *archive)
+{
+	int found = 0;
+
+	if (!select)
+		return 0;
+
+	sqlite3_bind_text(select, 1, archive->url, -1, SQLITE_STATIC);
+	sqlite3_bind_text(select, 2, archive->archive_hash, -1, SQLITE_STATIC);
+
+	if (sqlite3_step(select) == SQLITE_ROW) {
+		const void *content = sqlite3_column_blob(select, 0);
+		int size = sqlite3_column_bytes(select, 0);
+
+		archive->content = buffer_get();
+		utstring_bincpy(archive->content, content, size);
+		found = 1;
+	}
+
+	sqlite3_reset(select);
+	return found;
+}
+
+/* Follows the "# prev" links of every feed whose oldest tweet is still
+ * newer than since, round by round. The archives are appended to feeds,
+ * their tweets to tweets. Archives never change, so once fetched they
+ * are served from the database. */
+void feeds_load_archives(sqlite3 * db, UT_array * feeds,
+			 struct tweets *tweets, time_t since)
+{
+	sqlite3_stmt *select = NULL;
+	struct archive_load a = { tweets, NULL };
+	UT_array *fetch;
+	unsigned start = 0;
+
+	if (sqlite3_prepare_v2(db, "select content from archives"
+			       " where url = ? and hash = ?", -1, &select,
+			       NULL) != SQLITE_OK)
+		select = NULL;
+	if (sqlite3_prepare_v2(db, "insert or replace into archives"
+			       " values (?, ?, ?)", -1, &a.insert,
+			       NULL) != SQLITE_OK)
+		a.insert = NULL;
+
+	utarray_new(fetch, &ut_ptr_icd);
+
+	for (int round = 0; round < max_archive_depth; round++) {
+		unsigned end = utarray_len(feeds);
+
+		utarray_clear(fetch);
+		for (unsigned i = start; i < end; i++) {
+			struct feed *feed =
+			    *(struct feed **)utarray_eltptr(feeds, i);
+
+			if (!feed->prev_url || !feed->oldest
+			    || feed->oldest <= since)
+				continue;
+
+			struct feed *archive =
+			    feed_new(feed->nick, feed->prev_url);
+			archive->archive_hash = strdup(feed->prev_hash);
+			if (!archive->archive_hash)
+				oom();
+			utarray_push_back(feeds, &archive);
+
+			if (archive_cached(select, archive)) {
+				parse_twtfile(archive, tweets);
+				buffer_put(archive->content);
+				archive->content = NULL;
+			} else {
+				utarray_push_back(fetch, &archive);
+			}
+		}
+
+		if (end == utarray_len(feeds))
+			break;
+
+		if (utarray_len(fetch)) {
+			sql_do(db, "begin");
+			feeds_fetch(fetch, feed_parse_archive, &a);
+			sql_do(db, "commit");
+		}
+		start = end;
+	}
+
+	utarray_free(fetch);
+	sqlite3_finalize(select);
+	sqlite3_finalize(a.insert);
+}
+
+struct tweet_cache {
+	struct tweets *tweets;
+	sqlite3_stmt *select;
+	sqlite3_stmt *delete;
+	sqlite3_stmt *insert;
+};
+
+/* Takes the tweets of an unchanged feed from the tweets table instead of
+ * parsing it again, and refreshes the table for changed ones. */
+void feed_parse_cached(struct feed *feed, void *data)
+{
+	struct tweet_cache *cache = data;
+	struct tweets *tweets = cache->tweets;
+	int64_t nick = -1;
+
+	if (!feed_content_changed(feed)) {
+		sqlite3_bind_text(cache->select, 1, feed->url, -1,
+				  SQLITE_STATIC);
+		while (sqlite3_step(cache->select) == SQLITE_ROW) {
+			time_t timestamp = sqlite3_column_int64(cache->select, 0);
+			const char *msg =
+			    (const char *)sqlite3_column_text(cache->select, 1);
+
+			if (nick == -1)
+				nick = tweets_add_nick(tweets, feed->nick);
+			if (!feed->oldest || timestamp < feed->oldest)
+				feed->oldest = timestamp;
+			tweets_push(tweets, timestamp, nick, msg,
+				    sqlite3_column_bytes(cache->select, 1));
+		}
+		sqlite3_reset(cache->select);
+		return;
+	}
+
+	size_t first = tweets->size;
+
+	free(feed->prev_hash);
+	free(feed->prev_url);
+	feed->prev_hash = NULL;
+	feed->prev_url = NULL;
+	parse_twtfile(feed, tweets);
+
+	sqlite3_bind_text(cache->delete, 1, feed->url, -1, SQLITE_STATIC);
+	sqlite3_step(cache->delete);
+	sqlite3_reset(cache->delete);
+
+	for (size_t i = first; i < tweets->size; i++) {
+		sqlite3_bind_text(cache->insert, 1, feed->url, -1,
+				  SQLITE_STATIC);
+		sqlite3_bind_int64(cache->insert, 2, tweets->timestamps[i]);
+		sqlite3_bind_text(cache->insert, 3,
+				  utstring_body(tweets->text) + tweets->msgs[i],
+				  -1, SQLITE_STATIC);
+		sqlite3_step(cache->insert);
+		sqlite3_reset(cache->insert);
+	}
+}
+
+struct tweets *feeds_get_cached(sqlite3 * db, UT_array * feeds)
+{
+	struct tweet_cache cache = { NULL, NULL, NULL, NULL };
+
+	if (sqlite3_prepare_v2(db, "select timestamp, msg from tweets"
+			       " where url = ?", -1, &cache.select,
+			       NULL) != SQLITE_OK
+	    || sqlite3_prepare_v2(db, "delete from tweets where url = ?", -1,
+				  &cache.delete, NULL) != SQLITE_OK
+	    || sqlite3_prepare_v2(db, "insert into tweets values (?, ?, ?)",
+				  -1, &cache.insert, NULL) != SQLITE_OK) {
+		sqlite3_finalize(cache.select);
+		sqlite3_finalize(cache.delete);
+		return feeds_get(feeds);
+	}
+
+	cache.tweets = tweets_new();
+
+	sql_do(db, "begin");
+	feeds_fetch(feeds, feed_parse_cached, &cache);
+	sql_do(db, "commit");
+
+	sqlite3_finalize(cache.select);
+	sqlite3_finalize(cache.delete);
+	sqlite3_finalize(cache.insert);
+	return cache.tweets;
+}
+
+/* Sorts newest first with an LSD radix sort on the timestamps, skipping
+ * the byte positions all timestamps agree on. */
+void tweets_sort(struct tweets *tweets)
+{
+	size_t n = tweets->size;
+	size_t count[8][256];
+
+	if (n < 2)
+		return;
+
+	TRACE_BEGIN("tweets_sort");
+
+	uint64_t *keys = malloc(n * sizeof(uint64_t));
+	uint64_t *keys_tmp = malloc(n * sizeof(uint64_t));
+	size_t *order = malloc(n * sizeof(size_t));
+	size_t *order_tmp = malloc(n * sizeof(size_t));
+
+	if (!keys || !keys_tmp || !order || !order_tmp)
+		oom();
+
+	memset(count, 0, sizeof(count));
+
+	for (size_t i = 0; i < n; i++) {
+		/* flip the sign bit for unsigned order, invert for newest first */
+		uint64_t key = ~((uint64_t) tweets->timestamps[i] ^
+				 UINT64_C(0x8000000000000000));
+		keys[i] = key;
+		order[i] = i;
+		for (int b = 0; b < 8; b++) {
+			count[b][(key >> (b * 8)) & 0xff]++;
+		}
+	}
+
+	for (int b = 0; b < 8; b++) {
+		int shift = b * 8;
+
+		if (count[b][(keys[0] >> shift) & 0xff] == n)
+			continue;
+
+		size_t offset = 0;
+		for (int d = 0; d < 256; d++) {
+			size_t c = count[b][d];
+			count[b][d] = offset;
+			offset += c;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			size_t pos = count[b][(keys[i] >> shift) & 0xff]++;
+			keys_tmp[pos] = keys[i];
+			order_tmp[pos] = order[i];
+		}
+
+		uint64_t *k = keys;
+		keys = keys_tmp;
+		keys_tmp = k;
+
+		size_t *o = order;
+		order = order_tmp;
+		order_tmp = o;
+	}
+
+	free(keys_tmp);
+	free(order_tmp);
+
+	int64_t *timestamps = malloc(n * sizeof(int64_t));
+	size_t *msgs = malloc(n * sizeof(size_t));
+	uint32_t *nicks = malloc(n * sizeof(uint32_t));
+
+	if (!timestamps || !msgs || !nicks)
+		oom();
+
+	for (size_t i = 0; i < n; i++) {
+		timestamps[i] = tweets->timestamps[order[i]];
+		msgs[i] = tweets->msgs[order[i]];
+		nicks[i] = tweets->nicks[order[i]];
+	}
+
+	free(keys);
+	free(order);
+	free(tweets->timestamps);
+	free(tweets->msgs);
+	free(tweets->nicks);
+
+	tweets->timestamps = timestamps;
+	tweets->msgs = msgs;
+	tweets->nicks = nicks;
+	tweets->allocated = n;
+
+	TRACE_END("tweets_sort");
+}
+
+/* Drops the tweets older than since, tweets have to be sorted. */
+void tweets_since(struct tweets *tweets, time_t since)
+{
+	while (tweets->size && tweets->timestamps[tweets->size - 1] < since) {
+		tweets->size--;
+	}
+}
+
+void tweets_print(FILE * out, struct tweets *tweets, int oldest_first)
+{
+	char **nick_names = (char **)utarray_front(tweets->nick_names);
+	size_t buffer_size = 50;
+	char *timestamp = malloc(sizeof(char) * buffer_size);
+	if (!timestamp)
+		oom();
+
+	for (size_t n = 0; n < tweets->size; n++) {
+
+		size_t i = oldest_first ? tweets->size - n - 1 : n;
+		time_t d = tweets->timestamps[i];
+
+		while (strftime(timestamp, buffer_size, time_format,
+				localtime(&d)) == 0) {
+			timestamp = realloc(timestamp, buffer_size * 2);
+			if (!timestamp) {
+				oom();
+			}
+			buffer_size *= 2;
+		}
+
+		fprintf(out, "* %s (%s)\n%s\n\n", nick_names[tweets->nicks[i]],
+			timestamp, utstring_body(tweets->text) + tweets->msgs[i]);
+	}
+
+	free(timestamp);
+}
+
+void tweets_display(struct tweets *tweets)
+{
+
+	TRACE_BEGIN("tweets_display");
+
+	FILE *pager = stdout;
+	if (use_pager) {
+		TRACE_BEGIN("popen");
+		pager = popen(pager_cmd, "w");
+		TRACE_END("popen");
+	}
+
+	tweets_print(pager, tweets, 0);
+
+	fclose(pager);
+
+	TRACE_END("tweets_display");
+}
+
+struct watch {
+	struct tweets *pending;
+	struct tweets *scratch;
+	time_t interval;
+};
+
+/* Queues the tweets of feed not seen before and adapts its poll interval
+ * to how often it posts. */
+void feed_watch(struct feed *feed, void *data)
+{
+	struct watch *w = data;
+	struct tweets *scratch = w->scratch;
+	int64_t nick = -1;
+	size_t i;
+
+	if (!feed_content_changed(feed)) {
+		feed->interval += feed->interval / 2;
+		return;
+	}
+
+	tweets_clear(scratch);
+	parse_twtfile(feed, scratch);
+	tweets_sort(scratch);
+
+	for (i = 0; i < scratch->size && scratch->timestamps[i] > feed->newest;
+	     i++) {
+		const char *msg = utstring_body(scratch->text) + scratch->msgs[i];
+
+		if (nick == -1)
+			nick = tweets_add_nick(w->pending, feed->nick);
+		tweets_push(w->pending, scratch->timestamps[i], nick, msg,
+			    strlen(msg));
+	}
+
+	if (!i) {
+		feed->interval += feed->interval / 2;
+		return;
+	}
+
+	feed->newest = scratch->timestamps[0];
+
+	// poll at twice the rate of the last ten posts
+	size_t last = scratch->size < 10 ? scratch->size - 1 : 9;
+	if (last)
+		feed->interval = (scratch->timestamps[0]
+				  - scratch->timestamps[last]) / last / 2;
+}
+
+void feed_watch_finished(struct feed *feed, void *data)
+{
+	struct watch *w = data;
+
+	if (feed->response_code == 304)
+		feed->interval += feed->interval / 2;
+	else if (!feed_ok(feed))
+		feed->interval *= 2;
+
+	if (feed->interval < w->interval)
+		feed->interval = w->interval;
+	if (feed->interval > w->interval * 60)
+		feed->interval = w->interval * 60;
+
+	feed->attempts = 0;
+	feed->next_poll = time(NULL) + feed->interval;
+}
+
+/* Polls feeds forever, printing new tweets oldest first as they appear.
+ * Feeds are due every interval seconds at the most and every 60 intervals
+ * at the least. */
+void watch(UT_array * feeds, time_t interval)
+{
+	struct watch w = { tweets_new(), tweets_new(), interval };
+	struct fetcher f;
+	struct feed **p = NULL;
+	int initial = 1;
+
+	fetcher_init(&f, feed_watch, feed_watch_finished, &w);
+
+	/* feeds backing off after failures are first due at next_retry; the
+	 * first poll parses every feed to learn its newest tweet, whatever
+	 * hash the last run stored */
+	while ((p = (struct feed **)utarray_next(feeds, p))) {
+		time_t now = time(NULL);
+
+		(*p)->content_hashed = 0;
+		(*p)->interval = interval;
+		(*p)->next_poll = (*p)->next_retry > now
+		    ? (*p)->next_retry : now;
+	}
+
+	for (;;) {
+		time_t now = time(NULL);
+		time_t wake = now + interval;
+		int due = 0;
+
+		// next_poll is 0 while a feed is in flight
+		while ((p = (struct feed **)utarray_next(feeds, p))) {
+			struct feed *feed = *p;
+
+			if (!feed->next_poll)
+				continue;
+
+			if (feed->next_poll <= now) {
+				if (f.active < max_parallel) {
+					feed->next_poll = 0;
+					fetcher_start(&f, feed);
+					continue;
+				}
+				due++;
+			}
+
+			if (feed->next_poll < wake)
+				wake = feed->next_poll;
+		}
+
+		if (fetcher_idle(&f)) {
+			if (wake > now)
+				sleep(wake - now);
+		} else {
+			TRACE_BEGIN("fetcher_poll");
+			fetcher_poll(&f, 1000);
+			TRACE_END("fetcher_poll");
+		}
+
+		// the first round is printed in one piece once complete
+		if (initial && (!fetcher_idle(&f) || due))
+			continue;
+		initial = 0;
+
+		if (w.pending->size) {
+			tweets_sort(w.pending);
+			tweets_print(stdout, w.pending, 1);
+			fflush(stdout);
+			tweets_clear(w.pending);
+		}
+	}
+}
+
+void database_create(const char *filename)
+{
+	sqlite3 *db;
+	int rc = sqlite3_open(filename, &db);
+
+	if (rc == SQLITE_OK) {
+		sql_do(db,
+		       "create table followings"
+		       "(nick text unique, url text unique, last_modified,"
+		       " failures integer default 0,"
+		       " next_retry integer default 0, last_error text,"
+		       " content_hash, prev_hash text, prev_url text)");
+		/* databases created before feeds were backed off */
+		sql_do(db, "alter table followings"
+		       " add column failures integer default 0");
+		sql_do(db, "alter table followings"
+		       " add column next_retry integer default 0");
+		sql_do(db, "alter table followings add column last_error text");
+		sql_do(db, "alter table followings add column content_hash");
+		sql_do(db, "alter table followings add column prev_hash text");
+		sql_do(db, "alter table followings add column prev_url text");
+		sql_do(db,
+		       "create table tweets"
+		       "(url text, timestamp integer, msg text)");
+		sql_do(db, "create index tweets_url on tweets (url)");
+		sql_do(db,
+		       "create table mutes"
+		       "(type text, pattern text, primary key (type, pattern))");
+		sql_do(db,
+		       "create table archives"
+		       "(url text, hash text, content blob,"
+		       " primary key (url, hash))");
+		sql_do(db,
+		       "create table discovered"
+		       "(url text primary key, nick text, depth integer,"
+		       " followers integer)");
+	}
+
+	sqlite3_close(db);
+}
+
+void feeds_save_state(sqlite3 * db, UT_array * feeds)
+{
+	sqlite3_stmt *stmt;
+	struct feed **p = NULL;
+	time_t now = time(NULL);
+	char error[CURL_ERROR_SIZE];
+
+	int rc = sqlite3_prepare_v2(db,
+				    "update followings set failures = ?,"
+				    " next_retry = ?, last_error = ?,"
+				    " content_hash = ?, prev_hash = ?,"
+				    " prev_url = ? where url = ?", -1, &stmt,
+				    NULL);
+	if (rc != SQLITE_OK)
+		return;
+
+	sql_do(db, "begin");
+	while ((p = (struct feed **)utarray_next(feeds, p))) {
+		struct feed *feed = *p;
+
+		feed_backoff(feed, now);
+		sqlite3_bind_int(stmt, 1, feed->failures);
+		sqlite3_bind_int64(stmt, 2, feed->next_retry);
+		if (feed->failures) {
+			feed_error(feed, error, sizeof(error));
+			sqlite3_bind_text(stmt, 3, error, -1, SQLITE_TRANSIENT);
+		} else {
+			sqlite3_bind_null(stmt, 3);
+		}
+		if (feed->content_hashed)
+			sqlite3_bind_int64(stmt, 4,
+					   (sqlite3_int64) feed->content_hash);
+		else
+			sqlite3_bind_null(stmt, 4);
+		sqlite3_bind_text(stmt, 5, feed->prev_hash, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 6, feed->prev_url, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 7, feed->url, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sql_do(db, "commit");
+	sqlite3_finalize(stmt);
+}
+
+/* Compiles the muted words into muted_words, tweets containing any of
+ * them are dropped while parsing. Muted nicks are not fetched at all. */
+int mutes_load(sqlite3 * db)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, "select pattern from mutes"
+				" where type = 'word' order by pattern", -1,
+				&stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+
+	ac_free(muted_words);
+	muted_words = NULL;
+	mutes_seed = 0;
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *pattern = (const char *)sqlite3_column_text(stmt, 0);
+
+		if (!muted_words && !(muted_words = ac_new()))
+			oom();
+		if (ac_add(muted_words, pattern) != 0)
+			oom();
+		mutes_seed = xxh64(pattern, strlen(pattern) + 1, mutes_seed);
+	}
+
+	sqlite3_finalize(stmt);
+
+	if (muted_words && ac_compile(muted_words) != 0)
+		oom();
+
+	return 0;
+}
+
+int timeline(const char *filename, time_t watch_interval, time_t since)
+{
+
+	sqlite3 *db;
+	int rc = EXIT_SUCCESS;
+	// char *err_msg;
+
+	sqlite3_stmt *stmt;
+
+	TRACE_BEGIN("sqlite3_open");
+	rc = sqlite3_open(filename, &db);
+	TRACE_END("sqlite3_open");
+	if (rc != SQLITE_OK) {
+		return EXIT_FAILURE;
+	}
+
+	/* feeds backing off after failures are left out until next_retry,
+	 * watch mode loads them all and holds them back itself */
+	rc = sqlite3_prepare_v2(db,
+				"select nick, url, failures, content_hash,"
+				" prev_hash, prev_url, ifnull(next_retry, 0)"
+				" from followings"
+				" where ifnull(next_retry, 0) <= ?"
+				" and nick not in (select pattern from mutes"
+				" where type = 'nick')", -1, &stmt, NULL);
+
+	if (rc != SQLITE_OK) {
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+
+	sqlite3_bind_int64(stmt, 1, watch_interval ? LLONG_MAX : time(NULL));
+
+	if (mutes_load(db) != 0) {
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+
+	UT_array *feeds;
+	utarray_new(feeds, &ut_ptr_icd);
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		struct feed *feed =
+		    feed_new((const char *)sqlite3_column_text(stmt, 0),
+			     (const char *)sqlite3_column_text(stmt, 1));
+		feed->failures = sqlite3_column_int(stmt, 2);
+		if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+			feed->content_hash = sqlite3_column_int64(stmt, 3);
+			feed->content_hashed = 1;
+		}
+		if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
+			feed->prev_hash =
+			    strdup((const char *)sqlite3_column_text(stmt, 4));
+			feed->prev_url =
+			    strdup((const char *)sqlite3_column_text(stmt, 5));
+		}
+		feed->next_retry = sqlite3_column_int64(stmt, 6);
 
 		utarray_push_back(feeds, &feed);
 	}
 
 	sqlite3_finalize(stmt);
 
-	UT_array *tweets = feeds_get(feeds);
+	if (watch_interval) {
+		sqlite3_close(db);
+		watch(feeds, watch_interval);
+	}
+
+	struct tweets *tweets = feeds_get_cached(db, feeds);
+	feeds_save_state(db, feeds);
+	if (since)
+		feeds_load_archives(db, feeds, tweets, since);
+	sqlite3_close(db);
+
 	tweets_sort(tweets);
+	if (since)
+		tweets_since(tweets, since);
 	tweets_display(tweets);
-	return rc;
+	tweets_free(tweets);
+	return EXIT_SUCCESS;
+}
+
+int view(const char *filename, const char *nick, const char *url,
+	 time_t since, size_t tail)
+{
+	UT_array *feeds;
+	utarray_new(feeds, &ut_ptr_icd);
+
+	struct feed *feed = feed_new(nick, url);
+	utarray_push_back(feeds, &feed);
+
+	struct tweets *tweets;
+
+	if (tail) {
+		curl_global_init(CURL_GLOBAL_SSL);
+		if (feed_get_tail(feed, tail) != 0) {
+			fprintf(stderr, "txtio: %s: fetching feed failed\n", url);
+			return EXIT_FAILURE;
+		}
+		tweets = tweets_new();
+		parse_twtfile(feed, tweets);
+		curl_global_cleanup();
+	} else {
+		tweets = feeds_get(feeds);
+	}
+
+	if (since) {
+		sqlite3 *db;
+
+		if (sqlite3_open(filename, &db) == SQLITE_OK)
+			feeds_load_archives(db, feeds, tweets, since);
+		sqlite3_close(db);
+	}
+
+	tweets_sort(tweets);
+	if (since)
+		tweets_since(tweets, since);
+	if (tail && tweets->size > tail)
+		tweets->size = tail;
+	tweets_display(tweets);
+	tweets_free(tweets);
+	return EXIT_SUCCESS;
+}
+
+int status(const char *filename)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int rc;
+	time_t now = time(NULL);
+
+	rc = sqlite3_open(filename, &db);
+	if (rc != SQLITE_OK) {
+		return EXIT_FAILURE;
+	}
+
+	rc = sqlite3_prepare_v2(db,
+				"select nick, url, ifnull(failures, 0),"
+				" ifnull(next_retry, 0), last_error"
+				" from followings order by failures, nick",
+				-1, &stmt, NULL);
+
+	if (rc != SQLITE_OK) {
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *nick = (const char *)sqlite3_column_text(stmt, 0);
+		const char *url = (const char *)sqlite3_column_text(stmt, 1);
+		int failures = sqlite3_column_int(stmt, 2);
+		time_t next_retry = sqlite3_column_int64(stmt, 3);
+		const char *error = (const char *)sqlite3_column_text(stmt, 4);
+
+		if (!failures) {
+			printf("ok       %s %s\n", nick, url);
+		} else if (next_retry <= now) {
+			printf("retry    %s %s (%d failures: %s)\n", nick, url,
+			       failures, error ? error : "unknown error");
+		} else {
+			char until[64];
+			strftime(until, sizeof(until), "%Y-%m-%d %H:%M",
+				 localtime(&next_retry));
+			printf("backoff  %s %s (%d failures: %s, until %s)\n",
+			       nick, url, failures,
+			       error ? error : "unknown error", until);
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return EXIT_SUCCESS;
 }
 
 int follow(const char *filename, const char *nick, const char *url)
@@ -385,8 +1913,41 @@ int follow(const char *filename, const char *nick, const char *url)
 
 	char *query =
 	    sqlite3_mprintf
-	    ("insert or replace into followings values ('%q', '%q', 0);", nick,
-	     url);
+	    ("insert or replace into followings (nick, url, last_modified)"
+	     " values ('%q', '%q', 0);", nick, url);
+
+	rc = sqlite3_exec(db, query, NULL, NULL, &err_msg);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "SQL error: %s\n", err_msg);
+		rc = EXIT_FAILURE;
+	}
+
+	sqlite3_free(err_msg);
+	sqlite3_free(query);
+	sqlite3_close(db);
+
+	return rc;
+}
+
+
+int mute(const char *filename, const char *type, const char *pattern,
+	 int add)
+{
+	sqlite3 *db;
+	int rc = EXIT_SUCCESS;
+	char *err_msg = NULL;
+
+	rc = sqlite3_open(filename, &db);
+	if (rc != SQLITE_OK) {
+		return EXIT_FAILURE;
+	}
+
+	char *query = add ?
+	    sqlite3_mprintf("insert or replace into mutes values ('%q', '%q');",
+			    type, pattern) :
+	    sqlite3_mprintf("delete from mutes"
+			    " where type = '%q' and pattern = '%q';",
+			    type, pattern);
 
 	rc = sqlite3_exec(db, query, NULL, NULL, &err_msg);
 	if (rc != SQLITE_OK) {
@@ -401,8 +1962,335 @@ int follow(const char *filename, const char *nick, const char *url)
 	return rc;
 }
 
+int mutes_list(const char *filename)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = sqlite3_open(filename, &db);
+	if (rc != SQLITE_OK) {
+		return EXIT_FAILURE;
+	}
+
+	rc = sqlite3_prepare_v2(db, "select type, pattern from mutes"
+				" order by type, pattern", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		printf("%s %s\n", sqlite3_column_text(stmt, 0),
+		       sqlite3_column_text(stmt, 1));
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return EXIT_SUCCESS;
+}
+
+struct seen_feed {
+	struct feed *feed;
+	int followers;
+	UT_hash_handle hh;
+};
+
+struct discovery {
+	struct seen_feed *seen;
+	UT_array *queue;
+	int max_depth;
+};
+
+/* Queues feed unless its url was seen before; takes ownership of feed. */
+void discovery_add(struct discovery *d, struct feed *feed, int followers)
+{
+	struct seen_feed *s;
+
+	HASH_FIND_STR(d->seen, feed->url, s);
+	if (s) {
+		s->followers += followers;
+		feed_free(feed);
+		return;
+	}
+
+	s = malloc(sizeof(struct seen_feed));
+	if (!s)
+		oom();
+	s->feed = feed;
+	s->followers = followers;
+	HASH_ADD_KEYPTR(hh, d->seen, feed->url, strlen(feed->url), s);
+
+	if (feed->depth < d->max_depth)
+		utarray_push_back(d->queue, &feed);
+}
+
+void feed_discover(struct feed *feed, void *data)
+{
+	struct discovery *d = data;
+	struct feed **p = NULL;
+
+	utarray_new(feed->follows, &ut_ptr_icd);
+	parse_twtfile(feed, NULL);
+
+	while ((p = (struct feed **)utarray_next(feed->follows, p))) {
+		discovery_add(d, *p, 1);
+	}
+
+	utarray_free(feed->follows);
+	feed->follows = NULL;
+}
+
+int discover(const char *filename, int max_depth)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = sqlite3_open(filename, &db);
+	if (rc != SQLITE_OK) {
+		return EXIT_FAILURE;
+	}
+
+	rc = sqlite3_prepare_v2(db, "select nick, url from followings", -1,
+				&stmt, NULL);
+
+	if (rc != SQLITE_OK) {
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+
+	struct discovery d = { NULL, NULL, max_depth };
+	utarray_new(d.queue, &ut_ptr_icd);
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		struct feed *feed =
+		    feed_new((const char *)sqlite3_column_text(stmt, 0),
+			     (const char *)sqlite3_column_text(stmt, 1));
+		discovery_add(&d, feed, 0);
+	}
+
+	sqlite3_finalize(stmt);
+
+	/* crawl one level at a time, so every feed is first seen at its
+	 * shortest distance from the followings */
+	while (utarray_len(d.queue)) {
+		UT_array *level = d.queue;
+
+		utarray_new(d.queue, &ut_ptr_icd);
+		feeds_fetch(level, feed_discover, &d);
+		utarray_free(level);
+	}
+
+	rc = sqlite3_prepare_v2(db,
+				"insert or replace into discovered"
+				" values (?, ?, ?, ?)", -1, &stmt, NULL);
+
+	if (rc != SQLITE_OK) {
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+
+	unsigned count = 0;
+	struct seen_feed *s, *tmp;
+
+	sql_do(db, "begin");
+	sql_do(db, "delete from discovered");
+	HASH_ITER(hh, d.seen, s, tmp) {
+		sqlite3_bind_text(stmt, 1, s->feed->url, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, s->feed->nick, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 3, s->feed->depth);
+		sqlite3_bind_int(stmt, 4, s->followers);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+		count++;
+
+		HASH_DEL(d.seen, s);
+		feed_free(s->feed);
+		free(s);
+	}
+	sql_do(db, "commit");
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	utarray_free(d.queue);
+
+	printf("%u feeds discovered\n", count);
+	return EXIT_SUCCESS;
+}
+
+void feed_prefetched(struct feed *feed, void *data)
+{
+}
+
+/* Refreshes the shared cache for the union of the followings of all
+ * databases, so each url is fetched once however many users follow it. */
+int prefetch(int ndbs, char **dbs)
+{
+	struct discovery d = { NULL, NULL, 1 };
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int opened = 0;
+
+	if (!cache_dir) {
+		fprintf(stderr, "txtio: prefetch needs --cache-dir\n");
+		return EXIT_FAILURE;
+	}
+
+	utarray_new(d.queue, &ut_ptr_icd);
+
+	for (int i = 0; i < ndbs; i++) {
+		if (sqlite3_open_v2(dbs[i], &db, SQLITE_OPEN_READONLY, NULL)
+		    != SQLITE_OK
+		    || sqlite3_prepare_v2(db, "select nick, url from followings",
+					  -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "txtio: %s: %s\n", dbs[i],
+				sqlite3_errmsg(db));
+			sqlite3_close(db);
+			continue;
+		}
+
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			struct feed *feed =
+			    feed_new((const char *)sqlite3_column_text(stmt, 0),
+				     (const char *)sqlite3_column_text(stmt, 1));
+			discovery_add(&d, feed, 0);
+		}
+
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		opened++;
+	}
+
+	if (!opened) {
+		utarray_free(d.queue);
+		return EXIT_FAILURE;
+	}
+
+	feeds_fetch(d.queue, feed_prefetched, NULL);
+
+	struct seen_feed *s, *tmp;
+	HASH_ITER(hh, d.seen, s, tmp) {
+		HASH_DEL(d.seen, s);
+		feed_free(s->feed);
+		free(s);
+	}
+	utarray_free(d.queue);
+
+	return EXIT_SUCCESS;
+}
+
+curl_off_t parse_size(const char *s)
+{
+	char *end;
+	long long factor = 1;
+	errno = 0;
+	long long size = strtoll(s, &end, 10);
+
+	if (errno || end == s || size <= 0)
+		return -1;
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		factor = 1024;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		factor = 1024 * 1024;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		factor = 1024 * 1024 * 1024;
+		end++;
+		break;
+	}
+
+	if (*end || size > LLONG_MAX / factor)
+		return -1;
+
+	return size * factor;
+}
+
+int parse_count(const char *s)
+{
+	char *end;
+	errno = 0;
+	long n = strtol(s, &end, 10);
+
+	if (errno || end == s || *end || n < 0 || n > INT_MAX)
+		return -1;
+
+	return n;
+}
+
 int main(int argc, char **argv, char **env)
 {
+	static struct option options[] = {
+		{"max-size", required_argument, NULL, 'm'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"trace", required_argument, NULL, 't'},
+		{"cache-dir", required_argument, NULL, 'c'},
+		{"cache-ttl", required_argument, NULL, 'T'},
+		{NULL, 0, NULL, 0}
+	};
+	char *progname = argv[0];
+	int tracing = 0;
+	int opt;
+
+	cache_dir = getenv("TXTIO_CACHE_DIR");
+
+	while ((opt = getopt_long(argc, argv, "+m:j:t:c:T:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'm':
+			max_feed_size = parse_size(optarg);
+			if (max_feed_size == -1) {
+				fprintf(stderr, "%s: Invalid size \"%s\"\n",
+					progname, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			max_parallel = parse_count(optarg);
+			if (max_parallel < 1) {
+				fprintf(stderr, "%s: Invalid job count \"%s\"\n",
+					progname, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'T':
+			cache_ttl = parse_count(optarg);
+			if (cache_ttl < 1) {
+				fprintf(stderr, "%s: Invalid ttl \"%s\"\n",
+					progname, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			if (trace_open(optarg) != 0) {
+				fprintf(stderr, "%s: Tracing not available\n",
+					progname);
+				exit(EXIT_FAILURE);
+			}
+			tracing = 1;
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* leave the subcommand in argv[1] */
+	argc -= optind - 1;
+	argv += optind - 1;
+	argv[0] = progname;
+
+	srandom(time(NULL) ^ getpid());
+
 	UT_string *db_file;
 	utstring_new(db_file);
 
@@ -423,7 +2311,9 @@ int main(int argc, char **argv, char **env)
 		exit(EXIT_FAILURE);
 	}
 
+	TRACE_BEGIN("database_create");
 	database_create(utstring_body(db_file));
+	TRACE_END("database_create");
 
 	if (argc == 1) {
 		fprintf(stderr, "%s: Missing subcommand\n", argv[0]);
@@ -431,10 +2321,50 @@ int main(int argc, char **argv, char **env)
 	}
 
 	if (strcmp(argv[1], "timeline") == 0) {
-		if (argc != 2) {
-			fprintf(stderr, "%s: txtio timeline\n", argv[0]);
+		static struct option timeline_options[] = {
+			{"watch", no_argument, NULL, 'w'},
+			{"interval", required_argument, NULL, 'i'},
+			{"since", required_argument, NULL, 's'},
+			{NULL, 0, NULL, 0}
+		};
+		int watch_mode = 0;
+		long interval = 60;
+		time_t since = 0;
+
+		optind = 0;
+		while ((opt = getopt_long(argc - 1, argv + 1, "+wi:s:",
+					  timeline_options, NULL)) != -1) {
+			switch (opt) {
+			case 's':
+				since = parse_date(optarg);
+				break;
+			case 'w':
+				watch_mode = 1;
+				break;
+			case 'i':
+				interval = parse_count(optarg);
+				break;
+			default:
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (optind != argc - 1 || interval < 1 || since == -1
+		    || (watch_mode && since)) {
+			fprintf(stderr,
+				"%s: txtio timeline [--since DATE]"
+				" [--watch [--interval SECONDS]]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		// the trace is written at exit, which watch mode never reaches
+		if (watch_mode && tracing) {
+			fprintf(stderr,
+				"%s: --trace cannot be used with --watch\n",
+				argv[0]);
+			exit(EXIT_FAILURE);
 		}
-		timeline(utstring_body(db_file));
+		timeline(utstring_body(db_file), watch_mode ? interval : 0,
+			 since);
 
 	} else if (strcmp(argv[1], "follow") == 0) {
 		if (argc != 4) {
@@ -442,26 +2372,109 @@ int main(int argc, char **argv, char **env)
 			exit(EXIT_FAILURE);
 		}
 		follow(utstring_body(db_file), argv[2], argv[3]);
-	} else if (strcmp(argv[1], "view") == 0) {
-		if (argc != 4) {
-			fprintf(stderr, "%s: txtio view nick url\n", argv[0]);
+	} else if (strcmp(argv[1], "mute") == 0 && argc == 2) {
+		if (mutes_list(utstring_body(db_file)) != EXIT_SUCCESS) {
+			exit(EXIT_FAILURE);
+		}
+	} else if (strcmp(argv[1], "mute") == 0
+		   || strcmp(argv[1], "unmute") == 0) {
+		if (argc != 4 || (strcmp(argv[2], "nick") != 0
+				  && strcmp(argv[2], "word") != 0)) {
+			fprintf(stderr, "%s: txtio %s nick|word pattern\n",
+				argv[0], argv[1]);
+			exit(EXIT_FAILURE);
+		}
+		if (mute(utstring_body(db_file), argv[2], argv[3],
+			 strcmp(argv[1], "mute") == 0) != EXIT_SUCCESS) {
+			exit(EXIT_FAILURE);
+		}
+	} else if (strcmp(argv[1], "prefetch") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "%s: txtio prefetch db...\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (prefetch(argc - 2, argv + 2) != EXIT_SUCCESS) {
+			exit(EXIT_FAILURE);
+		}
+	} else if (strcmp(argv[1], "status") == 0) {
+		if (argc != 2) {
+			fprintf(stderr, "%s: txtio status\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (status(utstring_body(db_file)) != EXIT_SUCCESS) {
 			exit(EXIT_FAILURE);
 		}
-		UT_array *feeds;
-		utarray_new(feeds, &ut_ptr_icd);
+	} else if (strcmp(argv[1], "discover") == 0) {
+		static struct option discover_options[] = {
+			{"depth", required_argument, NULL, 'd'},
+			{NULL, 0, NULL, 0}
+		};
+		int depth = 1;
+
+		optind = 0;
+		while ((opt = getopt_long(argc - 1, argv + 1, "+d:",
+					  discover_options, NULL)) != -1) {
+			switch (opt) {
+			case 'd':
+				depth = parse_count(optarg);
+				if (depth == -1) {
+					fprintf(stderr,
+						"%s: Invalid depth \"%s\"\n",
+						argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				exit(EXIT_FAILURE);
+			}
+		}
 
-		struct feed *feed = malloc(sizeof(struct feed));
-		if (!feed) {
+		if (optind != argc - 1 || depth < 0) {
+			fprintf(stderr, "%s: txtio discover [--depth N]\n",
+				argv[0]);
 			exit(EXIT_FAILURE);
 		}
-		feed->nick = strdup(argv[2]);
-		feed->url = strdup(argv[3]);
-		utstring_new(feed->content);
-		utarray_push_back(feeds, &feed);
+		if (discover(utstring_body(db_file), depth) != EXIT_SUCCESS) {
+			exit(EXIT_FAILURE);
+		}
+	} else if (strcmp(argv[1], "view") == 0) {
+		static struct option view_options[] = {
+			{"since", required_argument, NULL, 's'},
+			{"tail", required_argument, NULL, 't'},
+			{NULL, 0, NULL, 0}
+		};
+		time_t since = 0;
+		long tail = 0;
+
+		optind = 0;
+		while ((opt = getopt_long(argc - 1, argv + 1, "+s:t:",
+					  view_options, NULL)) != -1) {
+			switch (opt) {
+			case 's':
+				since = parse_date(optarg);
+				break;
+			case 't':
+				tail = parse_count(optarg);
+				if (tail == 0) {
+					tail = -1;
+				}
+				break;
+			default:
+				exit(EXIT_FAILURE);
+			}
+		}
 
-		UT_array *tweets = feeds_get(feeds);
-		tweets_sort(tweets);
-		tweets_display(tweets);
+		if (optind != argc - 3 || since == -1 || tail == -1
+		    || (since && tail)) {
+			fprintf(stderr,
+				"%s: txtio view [--since DATE | --tail N] nick url\n",
+				argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (view(utstring_body(db_file), argv[optind + 1],
+			 argv[optind + 2], since, tail) != EXIT_SUCCESS) {
+			exit(EXIT_FAILURE);
+		}
 	} else {
 
 		fprintf(stderr, "%s: Unknown subcommand \"%s\"\n", argv[0],
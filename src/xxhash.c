@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "xxhash.h"
+
+/* XXH64 by Yann Collet, https://github.com/Cyan4973/xxHash */
+
+#define P1 UINT64_C(0x9E3779B185EBCA87)
+#define P2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define P3 UINT64_C(0x165667B19E3779F9)
+#define P4 UINT64_C(0x85EBCA77C2B2AE63)
+#define P5 UINT64_C(0x27D4EB2F165667C5)
+
+static uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+	return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16
+	    | (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32
+	    | (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48
+	    | (uint64_t) p[7] << 56;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+	    | (uint32_t) p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * P1 + P4;
+}
+
+void xxh64_reset(struct xxh64_state *s, uint64_t seed)
+{
+	memset(s, 0, sizeof(struct xxh64_state));
+	s->seed = seed;
+	s->v[0] = seed + P1 + P2;
+	s->v[1] = seed + P2;
+	s->v[2] = seed;
+	s->v[3] = seed - P1;
+}
+
+void xxh64_update(struct xxh64_state *s, const void *input, size_t len)
+{
+	const unsigned char *p = input;
+	const unsigned char *end = p + len;
+
+	s->total_len += len;
+
+	if (s->memsize + len < 32) {
+		memcpy(s->mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+
+	if (s->memsize) {
+		memcpy(s->mem + s->memsize, p, 32 - s->memsize);
+		p += 32 - s->memsize;
+		for (int i = 0; i < 4; i++) {
+			s->v[i] = round64(s->v[i], read64(s->mem + i * 8));
+		}
+		s->memsize = 0;
+	}
+
+	for (; p + 32 <= end; p += 32) {
+		for (int i = 0; i < 4; i++) {
+			s->v[i] = round64(s->v[i], read64(p + i * 8));
+		}
+	}
+
+	if (p < end) {
+		memcpy(s->mem, p, end - p);
+		s->memsize = end - p;
+	}
+}
+
+uint64_t xxh64_digest(const struct xxh64_state *s)
+{
+	const unsigned char *p = s->mem;
+	const unsigned char *end = p + s->memsize;
+	uint64_t h;
+
+	if (s->total_len >= 32) {
+		h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12)
+		    + rotl(s->v[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = merge64(h, s->v[i]);
+		}
+	} else {
+		h = s->seed + P5;
+	}
+
+	h += s->total_len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * P1 + P4;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t) read32(p) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+
+	for (; p < end; p++) {
+		h ^= *p * P5;
+		h = rotl(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t xxh64(const void *input, size_t len, uint64_t seed)
+{
+	struct xxh64_state s;
+
+	xxh64_reset(&s, seed);
+	xxh64_update(&s, input, len);
+	return xxh64_digest(&s);
+}
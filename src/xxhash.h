@@ -0,0 +1,11 @@
+struct xxh64_state {
+	uint64_t total_len;
+	uint64_t v[4];
+	unsigned char mem[32];
+	size_t memsize;
+	uint64_t seed;
+};
+void xxh64_reset(struct xxh64_state *s, uint64_t seed);
+void xxh64_update(struct xxh64_state *s, const void *input, size_t len);
+uint64_t xxh64_digest(const struct xxh64_state *s);
+uint64_t xxh64(const void *input, size_t len, uint64_t seed);